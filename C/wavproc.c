@@ -20,16 +20,24 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 
 #include "atcs.h"
 
 #define DEFAULT_FILENAME "test.txt"
 #define EXPECTED_ARGS (2)
 
+#define MEM_NONE (0)        // nothing loaded
+#define MEM_MAP_READ (2)    // private read-only mapping, only the header page is writable
+#define MEM_MAP_PRIVATE (3) // private copy-on-write mapping
+#define MEM_MAP_SHARED (4)  // shared writable mapping, writes go straight to the file
+
 struct MEM
     {
-    char *pmem; // pointer to memory
-    off_t *len; // length of the file
+    char *pmem;    // pointer to memory
+    off_t *len;    // length of the file
+    int how;       // how pmem was obtained, one of the MEM_ constants
+    size_t maplen; // length of the mapping, 0 when nothing is mapped
     };
 
 struct ERR
@@ -73,7 +81,8 @@ struct WAV
 
 void silentFail(const char *msg, const char *fname, const off_t *len);
 off_t flength(int unit);
-char* fload(char* fname, off_t *length);
+char* fmap(char* fname, int how, int advice, off_t *length, size_t *maplen);
+void funload(struct MEM *mem);
 struct ERR enforceWav(struct WAV *wav);
 struct ERR enforceSubformat(struct WAV *wav);
 void calculateFields(struct WAV *wav, off_t *length);
@@ -145,56 +154,70 @@ off_t flength(int unit)
     }
 
 /**
- * @brief the fload function loads a file into memory. The function
- * opens the file, gets the length of the file, allocates memory
- * for the file contents, reads the file into memory, and closes
- * the file. The function returns a pointer to the memory
- * containing the file contents.
- * @param fname the name of the file to open
+ * @brief the fmap function maps a file into memory instead of copying it.
+ * Nothing is read up front, pages are faulted in from the page cache as the
+ * filter touches them, so startup time and resident memory no longer scale
+ * with the size of the file. MEM_MAP_READ maps the file read-only except for
+ * the first page, which stays writable (copy-on-write) so calculateFields can
+ * still fix the header. MEM_MAP_PRIVATE maps the whole file copy-on-write and
+ * MEM_MAP_SHARED maps it writable so that changes land in the file itself.
+ * The advice is passed on to madvise as a readahead hint.
+ *
+ * @param fname the name of the file to map
+ * @param how one of MEM_MAP_READ, MEM_MAP_PRIVATE or MEM_MAP_SHARED
+ * @param advice the madvise hint for the mapping, MADV_NORMAL for none
  * @param length a pointer to the length of the file
- * @return char* a pointer to memory containing the file contents
- * @postcondition the caller is responsible for freeing the memory
+ * @param maplen a pointer to the length of the mapping
+ * @return char* a pointer to the mapping, NULL on failure
+ * @postcondition the caller is responsible for unmapping the memory with funload
  */
-char* fload(char* fname, off_t *length)
+char* fmap(char* fname, int how, int advice, off_t *length, size_t *maplen)
     {
     int unit = -1;
     off_t len;
     char* pmem = NULL;
-    ssize_t bytes;
+    void* map;
+    int flags, prot;
+    size_t page;
 
     if (fname != NULL)
         {
-        unit = open(fname, O_RDONLY | O_BINARY);
+        unit = open(fname, (how == MEM_MAP_SHARED ? O_RDWR : O_RDONLY) | O_BINARY);
         if (unit != -1)
             {
             len = flength(unit);
             if (len > 0)
                 {
-                pmem = (char*)malloc((size_t)len);
-                if (pmem != NULL)
+                prot = (how == MEM_MAP_READ) ? PROT_READ : PROT_READ | PROT_WRITE;
+                flags = (how == MEM_MAP_SHARED) ? MAP_SHARED : MAP_PRIVATE;
+                map = mmap(NULL, (size_t)len, prot, flags, unit, (off_t)0);
+                if (map != MAP_FAILED)
                     {
-                    bytes = read(unit, pmem, len);
-                    if ((off_t)bytes != len)
+                    pmem = (char*)map;
+                    page = (size_t)sysconf(_SC_PAGESIZE);
+                    if (how == MEM_MAP_READ && mprotect(map, page, PROT_READ | PROT_WRITE) != 0)
                         {
-                        fprintf(stderr, "Error during file reading: %s, with length %lld bytes\n", fname, (off_t)len);
-                        free(pmem);
-                        pmem = NULL;
+                        silentFail("Error making the header page writable", fname, &len);
                         }
-                    else if (length != NULL)
+
+                    if (advice != MADV_NORMAL && madvise(map, (size_t)len, advice) != 0)
                         {
-                        *length = len; // store the length in a pointer, used to calculate blank fields
+                        silentFail("Warning: readahead hint was ignored", fname, NULL);
                         }
+
+                    if (length != NULL) *length = len;
+                    if (maplen != NULL) *maplen = (size_t)len;
                     }
                 else
                     {
-                    silentFail("Error at malloc for file size", fname, &len);
+                    silentFail("Error at mmap for file", fname, &len);
                     }
                 }
             else
                 {
                 silentFail("Error when retrieving file length", fname, NULL);
                 }
-            close(unit);
+            close(unit); // the mapping keeps its own reference to the file
             }
         else
             {
@@ -209,6 +232,29 @@ char* fload(char* fname, off_t *length)
     return(pmem);
     }
 
+/**
+ * @brief the funload function releases the memory of a loaded file, it
+ * unmaps the mapping made by fmap.
+ *
+ * @param mem the loaded file to release
+ * @postcondition mem->pmem is NULL and mem->how is MEM_NONE
+ */
+void funload(struct MEM *mem)
+    {
+    if (mem->pmem != NULL)
+        {
+        if (mem->how != MEM_NONE && munmap(mem->pmem, mem->maplen) != 0)
+            {
+            silentFail("Error when unmapping file", NULL, NULL);
+            }
+        }
+
+    mem->pmem = NULL;
+    mem->maplen = 0;
+    mem->how = MEM_NONE;
+    return;
+    }
+
 /**
  * @brief The enforceWav function checks if the wav file is valid.
  * The function checks if the file is a valid wav file by checking
@@ -391,7 +437,8 @@ int validateWav(struct WAV *sound)
 
 /**
  * @brief the main function is the starting point of the program.
- * The function calls the fload function to load a file into memory.
+ * The function calls the fmap function to map the file into memory read-only,
+ * so only the header pages are ever read from disk.
  * The function checks if the file is a valid wav file and if the
  * subformat is PCM. The function also checks if the fields are correct
  * and calculates any missing fields.
@@ -404,7 +451,7 @@ int main(int argc, char* argv[])
     char *fname = NULL;
     struct MEM fcontent;
     struct WAV *sound = NULL;
-    int allocatedLength = FALSE, allocatedMem = FALSE;
+    int allocatedLength = FALSE;
 
     if (argc != EXPECTED_ARGS)
         {
@@ -417,8 +464,10 @@ int main(int argc, char* argv[])
         }
 
     fcontent.pmem = NULL;
+    fcontent.maplen = 0;
+    fcontent.how = MEM_MAP_READ;
     fcontent.len = (off_t *)malloc(sizeof(off_t));
-    fcontent.pmem = fload(fname, fcontent.len);
+    fcontent.pmem = fmap(fname, fcontent.how, MADV_NORMAL, fcontent.len, &fcontent.maplen);
 
     if (fcontent.len == NULL || *(fcontent.len) <= 0)
         {
@@ -432,11 +481,11 @@ int main(int argc, char* argv[])
     if (fcontent.pmem == NULL)
         {
         silentFail("Failed to load file into memory", NULL, NULL);
+        fcontent.how = MEM_NONE;
         }
     else
         {
         printf("Loaded the file successfully\n");
-        allocatedMem = TRUE;
         }
     
     sound = (struct WAV *)fcontent.pmem;
@@ -447,7 +496,7 @@ int main(int argc, char* argv[])
         calculateFields(sound, fcontent.len);
         }
     
-    if (allocatedMem) free(fcontent.pmem);
+    funload(&fcontent);
 
     if (allocatedLength) free(fcontent.len);
     exit(0);